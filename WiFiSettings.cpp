@@ -24,6 +24,7 @@
 #endif
 #include <DNSServer.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <vector>
 #include <WiFiSettings_strings.h>
 
@@ -31,15 +32,274 @@ WiFiSettingsLanguage::Texts _WSL_T;
 
 #define Sprintf(f, ...) ({ char* s; asprintf(&s, f, __VA_ARGS__); String r = s; free(s); r; })
 
+// Log levels: 0 = nothing, 1 = errors, 2 = warnings, 3 = info, 4 = debug.
+// Messages above the chosen level are not compiled in at all.
+#ifndef WIFISETTINGS_LOG_LEVEL
+    #define WIFISETTINGS_LOG_LEVEL 3
+#endif
+// Size in bytes of the in-memory log, viewable at /log in the portal; 0 = off.
+#ifndef WIFISETTINGS_LOG_BUFFER
+    #define WIFISETTINGS_LOG_BUFFER 0
+#endif
+#if WIFISETTINGS_LOG_LEVEL > 0 && WIFISETTINGS_LOG_BUFFER > 0
+    #define WSL_LOG_RING
+#endif
+
+// The unevaluated printf() gets the arguments checked against the format,
+// which the PSTR() on ESP8266 would otherwise prevent.
+#define WSL_LOG(fmt, ...) do {                      \
+    if (0) printf(fmt, ##__VA_ARGS__);              \
+    wsl_log(PSTR(fmt), ##__VA_ARGS__);              \
+} while (0)
+#if WIFISETTINGS_LOG_LEVEL >= 1
+    #define WSL_ERROR WSL_LOG
+#else
+    #define WSL_ERROR(...) do {} while (0)
+#endif
+#if WIFISETTINGS_LOG_LEVEL >= 2
+    #define WSL_WARN WSL_LOG
+#else
+    #define WSL_WARN(...) do {} while (0)
+#endif
+#if WIFISETTINGS_LOG_LEVEL >= 3
+    #define WSL_INFO WSL_LOG
+#else
+    #define WSL_INFO(...) do {} while (0)
+#endif
+#if WIFISETTINGS_LOG_LEVEL >= 4
+    #define WSL_DEBUG WSL_LOG
+#else
+    #define WSL_DEBUG(...) do {} while (0)
+#endif
+
 namespace {  // Helpers
+#ifdef WSL_LOG_RING
+    // Ring buffer of recent log lines. When it wraps, the oldest line may be
+    // partially overwritten; log_history() skips that remainder.
+    // Always room for at least one whole line: timestamp, message, newline.
+    static_assert(WIFISETTINGS_LOG_BUFFER > 16 + 128 + 1, "WIFISETTINGS_LOG_BUFFER is too small");
+    char log_ring[WIFISETTINGS_LOG_BUFFER];
+    size_t log_pos = 0;
+    bool log_wrapped = false;
+    bool log_oldest_starts_line = true;
+
+    void log_append(const char* str) {
+        while (*str) {
+            // The byte that is overwritten is the one that preceded the
+            // oldest byte that remains.
+            if (log_wrapped) log_oldest_starts_line = log_ring[log_pos] == '\n';
+            log_ring[log_pos++] = *str++;
+            if (log_pos == sizeof(log_ring)) {
+                log_pos = 0;
+                log_wrapped = true;
+            }
+        }
+    }
+
+    String log_history() {
+        String r;
+        r.reserve(sizeof(log_ring));
+        size_t i = log_wrapped ? log_pos : 0;
+        size_t n = log_wrapped ? sizeof(log_ring) : log_pos;
+        bool skip = log_wrapped && !log_oldest_starts_line;
+        while (n--) {
+            char c = log_ring[i++];
+            if (i == sizeof(log_ring)) i = 0;
+            if (skip) {
+                if (c == '\n') skip = false;
+                continue;
+            }
+            r += c;
+        }
+        return r;
+    }
+#endif
+
+#if WIFISETTINGS_LOG_LEVEL > 0
+    void wsl_log(const char* fmt, ...) {
+        char buf[128];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf_P(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+
+        Serial.println(buf);
+
+        #ifdef WSL_LOG_RING
+            char ts[16];
+            snprintf(ts, sizeof(ts), "%lu ", millis());
+            log_append(ts);
+            log_append(buf);
+            log_append("\n");
+        #endif
+    }
+#endif
+
+#ifdef WIFISETTINGS_RTC_CACHE
+    // Snapshot of the files read by slurp(), kept in RTC memory so that it
+    // survives deep sleep. After a deep sleep wake, settings are read from
+    // here instead of from the flash filesystem. Any other kind of reset, or
+    // any write through spurt(), throws the snapshot away.
+    //
+    // Layout of data: "filename\0content\0filename\0content\0..."
+
+    #ifndef WIFISETTINGS_RTC_CACHE_SIZE
+        #define WIFISETTINGS_RTC_CACHE_SIZE 384
+    #endif
+    #ifndef WIFISETTINGS_RTC_CACHE_OFFSET
+        // ESP8266 only; in 4-byte blocks. Blocks 0-31 are used for OTA.
+        #define WIFISETTINGS_RTC_CACHE_OFFSET 32
+    #endif
+
+    struct RTCCache {
+        uint32_t magic;
+        uint32_t checksum;
+        uint32_t used;
+        char data[(WIFISETTINGS_RTC_CACHE_SIZE - 12) & ~3];
+    };
+    static_assert(WIFISETTINGS_RTC_CACHE_SIZE >= 16, "WIFISETTINGS_RTC_CACHE_SIZE must be at least 16");
+    #ifdef ESP8266
+        static_assert(WIFISETTINGS_RTC_CACHE_OFFSET * 4 + sizeof(RTCCache) <= 512,
+            "WIFISETTINGS_RTC_CACHE doesn't fit in RTC user memory; reduce WIFISETTINGS_RTC_CACHE_SIZE or _OFFSET");
+    #endif
+
+    #ifdef ESP32
+        RTC_DATA_ATTR RTCCache rtc;
+    #else
+        RTCCache rtc;
+    #endif
+    bool rtc_loaded = false;
+    constexpr uint32_t rtc_magic = 0x57695365;
+
+    uint32_t rtc_checksum() {
+        uint32_t h = 2166136261u ^ rtc.used;  // FNV-1a
+        for (uint32_t i = 0; i < rtc.used; i++) {
+            h ^= (uint8_t) rtc.data[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    void rtc_save() {
+        rtc.magic = rtc_magic;
+        rtc.checksum = rtc_checksum();
+        #ifdef ESP8266
+            ESP.rtcUserMemoryWrite(WIFISETTINGS_RTC_CACHE_OFFSET, (uint32_t*) &rtc, sizeof(rtc));
+        #endif
+    }
+
+    void rtc_load() {
+        if (rtc_loaded) return;
+        rtc_loaded = true;
+
+        #ifdef ESP32
+            bool woke = esp_reset_reason() == ESP_RST_DEEPSLEEP;
+        #else
+            bool woke = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+            if (woke) ESP.rtcUserMemoryRead(WIFISETTINGS_RTC_CACHE_OFFSET, (uint32_t*) &rtc, sizeof(rtc));
+        #endif
+
+        if (woke
+            && rtc.magic == rtc_magic
+            && rtc.used <= sizeof(rtc.data)
+            && (rtc.used == 0 || rtc.data[rtc.used - 1] == '\0')
+            && rtc.checksum == rtc_checksum()
+        ) return;
+
+        rtc.used = 0;
+        rtc_save();
+    }
+
+    bool rtc_get(const String& fn, String& content) {
+        rtc_load();
+        const char* end = rtc.data + rtc.used;
+        const char* k = rtc.data;
+        while (k < end) {
+            const char* v = k + strlen(k) + 1;
+            if (v >= end) break;
+            if (fn == k) {
+                content = v;
+                return true;
+            }
+            k = v + strlen(v) + 1;
+        }
+        return false;
+    }
+
+    // The WiFi credentials are read last, by connect(), but are the most
+    // important to keep; other files make room for them if needed.
+    bool rtc_priority(const char* fn) {
+        return !strcmp(fn, "/wifi-ssid") || !strcmp(fn, "/wifi-password");
+    }
+
+    // Removes the most recently added entry that isn't a priority file.
+    bool rtc_evict() {
+        char* end = rtc.data + rtc.used;
+        char* victim = NULL;
+        char* victim_end = NULL;
+        for (char* k = rtc.data; k < end; ) {
+            char* v = k + strlen(k) + 1;
+            char* next = v + strlen(v) + 1;
+            if (!rtc_priority(k)) {
+                victim = k;
+                victim_end = next;
+            }
+            k = next;
+        }
+        if (!victim) return false;
+
+        memmove(victim, victim_end, end - victim_end);
+        rtc.used -= victim_end - victim;
+        return true;
+    }
+
+    void rtc_put(const String& fn, const String& content) {
+        unsigned int fl = fn.length() + 1, cl = content.length() + 1;
+        // If it doesn't fit, it will simply be read from flash next time.
+        while (rtc.used + fl + cl > sizeof(rtc.data)) {
+            if (fl + cl > sizeof(rtc.data) || !rtc_priority(fn.c_str()) || !rtc_evict()) {
+                WSL_DEBUG("RTC cache full; %s will be read from flash.", fn.c_str());
+                rtc_save();  // in case anything was evicted
+                return;
+            }
+            WSL_DEBUG("Evicted an entry from the RTC cache to make room for %s.", fn.c_str());
+        }
+
+        memcpy(rtc.data + rtc.used, fn.c_str(), fl);
+        rtc.used += fl;
+        memcpy(rtc.data + rtc.used, content.c_str(), cl);
+        rtc.used += cl;
+        rtc_save();
+    }
+
+    void rtc_clear() {
+        rtc_load();
+        rtc.used = 0;
+        rtc_save();
+    }
+#endif
+
     String slurp(const String& fn) {
+        #ifdef WIFISETTINGS_RTC_CACHE
+            String cached;
+            if (rtc_get(fn, cached)) return cached;
+        #endif
+
         File f = ESPFS.open(fn, "r");
         String r = f.readString();
         f.close();
+
+        #ifdef WIFISETTINGS_RTC_CACHE
+            rtc_put(fn, r);
+        #endif
         return r;
     }
 
     bool spurt(const String& fn, const String& content) {
+        #ifdef WIFISETTINGS_RTC_CACHE
+            rtc_clear();
+        #endif
+
         File f = ESPFS.open(fn, "w");
         if (!f) return false;
         auto w = f.print(content);
@@ -244,12 +504,12 @@ void WiFiSettingsClass::portal() {
         WiFi.disconnect(true);
     #endif
 
-    Serial.println(F("Starting access point for configuration portal."));
+    WSL_INFO("Starting access point for configuration portal.");
     if (secure && password.length()) {
-        Serial.printf("SSID: '%s', Password: '%s'\n", hostname.c_str(), password.c_str());
+        WSL_INFO("SSID: '%s', Password: '%s'", hostname.c_str(), password.c_str());
         WiFi.softAP(hostname.c_str(), password.c_str());
     } else {
-        Serial.printf("SSID: '%s'\n", hostname.c_str());
+        WSL_INFO("SSID: '%s'", hostname.c_str());
         WiFi.softAP(hostname.c_str());
     }
     delay(500);
@@ -258,7 +518,7 @@ void WiFiSettingsClass::portal() {
 
     if (onPortal) onPortal();
     String ip = WiFi.softAPIP().toString();
-    Serial.println(ip);
+    WSL_INFO("%s", ip.c_str());
 
     auto redirect = [&http, &ip]() {
         // iPhone doesn't deal well with redirects to http://hostname/ and
@@ -272,10 +532,16 @@ void WiFiSettingsClass::portal() {
         return true;
     };
 
-    const char* headers[] = {"User-Agent"};
+    // The page itself only changes when the configuration is saved, so it can
+    // be cached by the browser until then. The network list is a separate
+    // fragment that is fetched by the page.
+    auto new_etag = []() -> String { return "\"" + String(random(LONG_MAX), HEX) + "\""; };
+    String etag = new_etag();
+
+    const char* headers[] = {"User-Agent", "If-None-Match"};
     http.collectHeaders(headers, sizeof(headers) / sizeof(char*));
 
-    http.on("/", HTTP_GET, [this, &http, &num_networks, &redirect]() {
+    http.on("/", HTTP_GET, [this, &http, &etag, &redirect]() {
         if (redirect()) return;
 
         String ua = http.header("User-Agent");
@@ -284,6 +550,13 @@ void WiFiSettingsClass::portal() {
         if (interactive && onPortalView) onPortalView();
         if (onUserAgent) onUserAgent(ua);
 
+        http.sendHeader("Cache-Control", "no-cache");
+        http.sendHeader("ETag", etag);
+        if (http.header("If-None-Match") == etag) {
+            http.send(304);
+            return;
+        }
+
         http.setContentLength(CONTENT_LENGTH_UNKNOWN);
         http.send(200, "text/html");
         http.sendContent(F("<!DOCTYPE html>\n<meta charset=UTF-8><title>"));
@@ -315,48 +588,36 @@ void WiFiSettingsClass::portal() {
         http.sendContent(_WSL_T.title);
         http.sendContent(F("</h1><form method=post><label>"));
         http.sendContent(_WSL_T.ssid);
-        http.sendContent(F(":<br><b class=s>"));
+        // Until the network list is loaded, the select holds only the saved
+        // SSID, so saving the form in the meantime doesn't change it. Without
+        // JavaScript, the select stays disabled and hidden and a text input is
+        // used instead.
+        String saved_ssid = html_entities(slurp("/wifi-ssid"));
+        http.sendContent(F(":<br><noscript><style>#s,#r{display:none}</style><input name=ssid value='"));
+        http.sendContent(saved_ssid);
+        http.sendContent(F(
+            "'></noscript>"
+            "<select id=s name=ssid disabled onchange=\"document.getElementsByName('password')[0].value=''\">"
+            "<option value='"
+        ));
+        http.sendContent(saved_ssid);
+        http.sendContent("' selected>");
         http.sendContent(_WSL_T.scanning_long);
-        http.sendContent("</b>");
-
-        // Don't waste time scanning in captive portal detection (Apple)
-        if (interactive) {
-            if (num_networks < 0) num_networks = WiFi.scanNetworks();
-            Serial.print(num_networks, DEC);
-            Serial.println(F(" WiFi networks found."));
-        }
-
         http.sendContent(F(
-            "<style>.s{display:none}</style>"   // hide "scanning"
-            "<select name=ssid onchange=\"document.getElementsByName('password')[0].value=''\">"
+            "</select></label> "
+            "<a id=r href=/rescan onclick=\"var a=this,t=a.innerHTML;n('?rescan=1',function(){a.innerHTML=t});a.innerHTML='"
         ));
-
-        ssid = slurp("/wifi-ssid");
-        bool found = false;
-        for (int i = 0; i < num_networks; i++) {
-            String opt = F("<option value='{ssid}'{sel}>{ssid} {lock} {1x}</option>");
-            String s = WiFi.SSID(i);
-            wifi_auth_mode_t mode = WiFi.encryptionType(i);
-
-            opt.replace("{sel}",  s == ssid && !found ? " selected" : "");
-            opt.replace("{ssid}", html_entities(s));
-            opt.replace("{lock}", mode != WIFI_AUTH_OPEN ? "&#x1f512;" : "");
-            opt.replace("{1x}",   mode == WIFI_AUTH_WPA2_ENTERPRISE ? _WSL_T.dot1x : F(""));
-            http.sendContent(opt);
-
-            if (s == ssid) found = true;
-        }
-        if (!found && ssid.length()) {
-            String opt = F("<option value='{ssid}' selected>{ssid} (&#x26a0; not in range)</option>");
-            opt.replace("{ssid}", html_entities(ssid));
-            http.sendContent(opt);
-        }
-
-        http.sendContent(F("</select></label> <a href=/rescan onclick=\"this.innerHTML='"));
         http.sendContent(_WSL_T.scanning_short);
-        http.sendContent("';\">");
+        http.sendContent("';return false\">");
         http.sendContent(_WSL_T.rescan);
-        http.sendContent(F("</a><p><label>"));
+        http.sendContent(F(
+            "</a><script>"
+            "function n(q,f){var s=document.getElementById('s');"
+            "fetch('/networks'+q).then(function(r){if(!r.ok)throw r;return r.text()}).then(function(t){s.innerHTML=t})"
+            ".catch(function(){}).then(function(){if(f)f()})}"
+            "document.getElementById('s').disabled=false;n('')"
+            "</script><p><label>"
+        ));
 
         http.sendContent(_WSL_T.wifi_password);
         http.sendContent(F(":<br><input name=password value='"));
@@ -390,7 +651,42 @@ void WiFiSettingsClass::portal() {
         http.sendContent(F("\"style='font-size:150%'></form>"));
     });
 
-    http.on("/", HTTP_POST, [this, &http]() {
+    http.on("/networks", HTTP_GET, [this, &http, &num_networks]() {
+        if (num_networks < 0 || http.hasArg("rescan")) {
+            num_networks = WiFi.scanNetworks();
+            WSL_DEBUG("%d WiFi networks found.", num_networks);
+        }
+
+        http.sendHeader("Cache-Control", "no-store");
+        http.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        http.send(200, "text/html");
+
+        ssid = slurp("/wifi-ssid");
+        bool found = false;
+        for (int i = 0; i < num_networks; i++) {
+            String opt = F("<option value='{ssid}'{sel}>{ssid} {lock} {1x}</option>");
+            String s = WiFi.SSID(i);
+            wifi_auth_mode_t mode = WiFi.encryptionType(i);
+
+            opt.replace("{sel}",  s == ssid && !found ? " selected" : "");
+            opt.replace("{ssid}", html_entities(s));
+            opt.replace("{lock}", mode != WIFI_AUTH_OPEN ? "&#x1f512;" : "");
+            opt.replace("{1x}",   mode == WIFI_AUTH_WPA2_ENTERPRISE ? _WSL_T.dot1x : F(""));
+            http.sendContent(opt);
+
+            if (s == ssid) found = true;
+        }
+        if (!found && ssid.length()) {
+            String opt = F("<option value='{ssid}' selected>{ssid} (&#x26a0; not in range)</option>");
+            opt.replace("{ssid}", html_entities(ssid));
+            http.sendContent(opt);
+        }
+    });
+
+    http.on("/", HTTP_POST, [this, &http, &etag, &new_etag]() {
+        // Even a partially failed save may have changed something
+        etag = new_etag();
+
         bool ok = true;
         if (! spurt("/wifi-ssid", http.arg("ssid"))) ok = false;
 
@@ -418,6 +714,7 @@ void WiFiSettingsClass::portal() {
             if (onConfigSaved) onConfigSaved();
         } else {
             // Could be missing SPIFFS.begin(), unformatted filesystem, or broken flash.
+            WSL_ERROR("Error while writing to flash filesystem.");
             http.send(500, "text/plain", _WSL_T.error_fs);
         }
     });
@@ -432,8 +729,15 @@ void WiFiSettingsClass::portal() {
         http.sendHeader("Location", "/");
         http.send(302, "text/plain", _WSL_T.wait);
         num_networks = WiFi.scanNetworks();
+        WSL_DEBUG("%d WiFi networks found.", num_networks);
     });
 
+    #ifdef WSL_LOG_RING
+        http.on("/log", HTTP_GET, [&http]() {
+            http.send(200, "text/plain", log_history());
+        });
+    #endif
+
     http.onNotFound([this, &http, &redirect]() {
         if (redirect()) return;
         http.send(404, "text/plain", "404");
@@ -456,12 +760,11 @@ bool WiFiSettingsClass::connect(bool portal, int wait_seconds) {
     ssid = slurp("/wifi-ssid");
     String pw = slurp("/wifi-password");
     if (ssid.length() == 0) {
-        Serial.println(F("First contact!\n"));
+        WSL_INFO("First contact!");
         this->portal();
     }
 
-    Serial.print(F("Connecting to WiFi SSID "));
-    Serial.print(ssid);
+    WSL_INFO("Connecting to WiFi SSID %s", ssid.c_str());
     if (onConnect) onConnect();
 
     WiFi.setHostname(hostname.c_str());
@@ -474,18 +777,18 @@ bool WiFiSettingsClass::connect(bool portal, int wait_seconds) {
 
     unsigned long starttime = millis();
     while (WiFi.status() != WL_CONNECTED && (wait_seconds < 0 || (millis() - starttime) < (unsigned)wait_seconds * 1000)) {
-        Serial.print(".");
         delay(onWaitLoop ? onWaitLoop() : 100);
     }
 
     if (WiFi.status() != WL_CONNECTED) {
-        Serial.println(F(" failed."));
+        WSL_WARN("Connection to WiFi failed after %lu ms.", millis() - starttime);
         if (onFailure) onFailure();
         if (portal) this->portal();
         return false;
     }
 
-    Serial.println(WiFi.localIP().toString());
+    WSL_DEBUG("Connected to WiFi in %lu ms.", millis() - starttime);
+    WSL_INFO("%s", WiFi.localIP().toString().c_str());
     if (onSuccess) onSuccess();
     return true;
 }
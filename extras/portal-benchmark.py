@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+"""
+Load and latency benchmark for the WiFiSettings configuration portal.
+
+Simulates a room full of phones connecting to the portal at once: every
+simulated client does DNS lookups, the captive portal detection requests of
+its platform, and then loads and uses the portal page like a person would.
+Reports requests per second, p50/p99 latency, and bytes received per request
+type.
+
+Run it on a computer that is connected to the portal's access point:
+
+    python3 portal-benchmark.py --clients 8 --duration 60
+
+Only the Python standard library is needed. With --post, the configuration is
+saved too: the current values are read from the page and posted back
+unchanged, but this does write to the flash filesystem of the device.
+"""
+
+import argparse
+import html.parser
+import random
+import socket
+import struct
+import threading
+import time
+import urllib.parse
+
+IOS_PROBE_UA = "CaptiveNetworkSupport-407.40.1 wispr"
+IOS_UA = ("Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) "
+          "AppleWebKit/605.1.15 (KHTML, like Gecko) Mobile/15E148")
+ANDROID_PROBE_UA = "Dalvik/2.1.0 (Linux; U; Android 14; Pixel 7)"
+ANDROID_UA = ("Mozilla/5.0 (Linux; Android 14; Pixel 7) AppleWebKit/537.36 "
+              "(KHTML, like Gecko) Chrome/120.0 Mobile Safari/537.36")
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.samples = {}  # kind -> [(seconds, bytes, ok)]
+
+    def add(self, kind, seconds, nbytes, ok):
+        with self.lock:
+            self.samples.setdefault(kind, []).append((seconds, nbytes, ok))
+
+    def report(self, elapsed):
+        def pct(sorted_values, p):
+            i = min(len(sorted_values) - 1, int(round(p / 100 * (len(sorted_values) - 1))))
+            return sorted_values[i]
+
+        print("%-14s %7s %6s %8s %9s %9s %10s" % (
+            "request", "count", "errors", "req/s", "p50 ms", "p99 ms", "bytes/req"))
+        total = errors = 0
+        for kind in sorted(self.samples):
+            s = self.samples[kind]
+            ok = sorted(t for t, _, good in s if good)
+            err = len(s) - len(ok)
+            total += len(s)
+            errors += err
+            nbytes = sum(b for _, b, good in s if good)
+            print("%-14s %7d %6d %8.1f %9s %9s %10s" % (
+                kind, len(s), err, len(s) / elapsed,
+                "%.1f" % (pct(ok, 50) * 1000) if ok else "-",
+                "%.1f" % (pct(ok, 99) * 1000) if ok else "-",
+                "%d" % (nbytes / len(ok)) if ok else "-",
+            ))
+        print("%-14s %7d %6d %8.1f" % ("total", total, errors, total / elapsed))
+
+
+class Response:
+    def __init__(self, raw):
+        self.nbytes = len(raw)
+        head, _, body = raw.partition(b"\r\n\r\n")
+        lines = head.decode("latin-1").split("\r\n")
+        self.status = int(lines[0].split()[1]) if lines and len(lines[0].split()) > 1 else 0
+        self.headers = {}
+        for line in lines[1:]:
+            k, _, v = line.partition(":")
+            self.headers[k.strip().lower()] = v.strip()
+        if self.headers.get("transfer-encoding", "").lower() == "chunked":
+            body = self.dechunk(body)
+        self.body = body.decode("utf-8", "replace")
+
+    @staticmethod
+    def dechunk(data):
+        out = b""
+        while data:
+            size, _, data = data.partition(b"\r\n")
+            n = int(size.split(b";")[0] or b"0", 16)
+            if n == 0:
+                break
+            out += data[:n]
+            data = data[n + 2:]
+        return out
+
+
+class FormParser(html.parser.HTMLParser):
+    """Collects the current values of the main form, like a browser would."""
+
+    def __init__(self):
+        super().__init__()
+        self.fields = []
+        self.in_form = False
+        self.select = None
+        self.select_value = None
+
+    def handle_starttag(self, tag, attrs):
+        a = dict(attrs)
+        if tag == "form" and a.get("method") == "post" and "action" not in a:
+            self.in_form = True
+        if not self.in_form:
+            return
+        if tag == "input" and a.get("name"):
+            if a.get("type") == "checkbox":
+                if "checked" in a:
+                    self.fields.append((a["name"], a.get("value", "on")))
+            elif a.get("type") != "submit":
+                self.fields.append((a["name"], a.get("value") or ""))
+        elif tag == "select" and a.get("name") and a.get("name") != "ssid":
+            self.select, self.select_value = a["name"], None
+        elif tag == "option" and self.select:
+            if self.select_value is None or "selected" in a:
+                self.select_value = a.get("value", "")
+
+    def handle_endtag(self, tag):
+        if tag == "select" and self.select:
+            self.fields.append((self.select, self.select_value or ""))
+            self.select = None
+        elif tag == "form":
+            self.in_form = False
+
+
+class Client:
+    def __init__(self, args, stats, platform, index):
+        self.args = args
+        self.stats = stats
+        self.platform = platform
+        self.rng = random.Random(None if args.seed is None else args.seed + index)
+        self.etag = None
+        self.page = None
+
+    def http(self, kind, method, path, host=None, ua=None, headers=(), body=b""):
+        req = "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n" % (
+            method, path, host or self.args.host)
+        if ua:
+            req += "User-Agent: %s\r\n" % ua
+        for h in headers:
+            req += h + "\r\n"
+        if body:
+            req += "Content-Type: application/x-www-form-urlencoded\r\n"
+            req += "Content-Length: %d\r\n" % len(body)
+        req = req.encode("latin-1") + b"\r\n" + body
+
+        start = time.monotonic()
+        raw = b""
+        try:
+            with socket.create_connection((self.args.host, 80), timeout=self.args.timeout) as s:
+                s.sendall(req)
+                while True:
+                    chunk = s.recv(4096)
+                    if not chunk:
+                        break
+                    raw += chunk
+            r = Response(raw)
+        except (OSError, ValueError, IndexError):
+            self.stats.add(kind, time.monotonic() - start, len(raw), False)
+            return None
+        self.stats.add(kind, time.monotonic() - start, r.nbytes, 200 <= r.status < 400)
+        return r
+
+    def dns(self, name):
+        qid = self.rng.randrange(65536)
+        query = struct.pack(">HHHHHH", qid, 0x0100, 1, 0, 0, 0)
+        for label in name.split("."):
+            query += bytes([len(label)]) + label.encode()
+        query += b"\0" + struct.pack(">HH", 1, 1)
+
+        start = time.monotonic()
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+            s.settimeout(self.args.timeout)
+            try:
+                s.sendto(query, (self.args.host, 53))
+                data, _ = s.recvfrom(512)
+                ok = len(data) >= 2 and struct.unpack(">H", data[:2])[0] == qid
+            except OSError:
+                data, ok = b"", False
+        self.stats.add("dns", time.monotonic() - start, len(data), ok)
+
+    def think(self):
+        time.sleep(self.rng.uniform(0, self.args.think))
+
+    def probe(self):
+        if self.platform == "ios":
+            for _ in range(3):
+                self.dns("captive.apple.com")
+            self.http("probe-ios", "GET", "/hotspot-detect.html",
+                      host="captive.apple.com", ua=IOS_PROBE_UA)
+            self.http("page", "GET", "/", ua=IOS_PROBE_UA)
+        else:
+            for name in ("connectivitycheck.gstatic.com", "www.google.com", "clients3.google.com"):
+                self.dns(name)
+            self.http("probe-android", "GET", "/generate_204",
+                      host="connectivitycheck.gstatic.com", ua=ANDROID_PROBE_UA)
+
+    def view(self):
+        ua = IOS_UA if self.platform == "ios" else ANDROID_UA
+        headers = ["If-None-Match: %s" % self.etag] if self.etag else []
+        r = self.http("page" if not self.etag else "page-cached", "GET", "/", ua=ua, headers=headers)
+        if r and r.status == 200:
+            self.page = r.body
+            self.etag = r.headers.get("etag")
+        self.http("networks", "GET", "/networks", ua=ua)
+
+    def rescan(self):
+        ua = IOS_UA if self.platform == "ios" else ANDROID_UA
+        self.http("rescan", "GET", "/networks?rescan=1", ua=ua)
+
+    def save(self):
+        if not self.page:
+            return
+        p = FormParser()
+        p.feed(self.page)
+        body = urllib.parse.urlencode(p.fields).encode()
+        ua = IOS_UA if self.platform == "ios" else ANDROID_UA
+        self.http("post", "POST", "/", ua=ua, body=body)
+        self.etag = None
+
+    def run(self, deadline):
+        self.probe()
+        self.think()
+        while time.monotonic() < deadline:
+            self.view()
+            self.think()
+            action = self.rng.random()
+            if action < self.args.rescan:
+                self.rescan()
+            elif self.args.post and action < self.args.rescan + 0.1:
+                self.save()
+            self.think()
+            if self.rng.random() < 0.3:
+                self.probe()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[1],
+                                 formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--host", default="192.168.4.1", help="portal IP address (default: %(default)s)")
+    ap.add_argument("--clients", type=int, default=8, help="simulated phones (default: %(default)s)")
+    ap.add_argument("--ios", type=float, default=0.5, help="fraction of iOS clients (default: %(default)s)")
+    ap.add_argument("--duration", type=float, default=60, help="seconds (default: %(default)s)")
+    ap.add_argument("--think", type=float, default=2, help="max seconds between actions (default: %(default)s)")
+    ap.add_argument("--rescan", type=float, default=0.1, help="chance of a rescan per view (default: %(default)s)")
+    ap.add_argument("--post", action="store_true", help="also save the (unchanged) configuration")
+    ap.add_argument("--timeout", type=float, default=10, help="per request, in seconds (default: %(default)s)")
+    ap.add_argument("--seed", type=int, help="random seed, for reproducible runs")
+    args = ap.parse_args()
+
+    stats = Stats()
+    n_ios = int(round(args.clients * args.ios))
+    clients = [Client(args, stats, "ios" if i < n_ios else "android", i) for i in range(args.clients)]
+
+    start = time.monotonic()
+    deadline = start + args.duration
+    threads = [threading.Thread(target=c.run, args=(deadline,), daemon=True) for c in clients]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    stats.report(time.monotonic() - start)
+
+
+if __name__ == "__main__":
+    main()